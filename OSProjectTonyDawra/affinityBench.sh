@@ -0,0 +1,75 @@
+#!/bin/sh
+# Compare command locality and throughput with client threads floating and pinned.
+#
+# Usage: ./affinityBench.sh [bots] [commands per bot] [cpu list] [port]
+#
+# Each run starts ./server with rate limits disabled and locality counting (-S) on,
+# lets headless bots pipeline ping commands, then reads the server's "affinity"
+# counters: commands handled on the CPU that received their packets, elsewhere on
+# the same node, or on another node. When perf is installed the server also runs under perf stat, and the
+# node-load-misses counter (loads served from another node's memory) measures the
+# cross-node traffic itself. Build ./server and ./client first.
+
+BOTS=${1:-8}
+COMMANDS=${2:-20000}
+CPUS=${3:-0-$(($(nproc) - 1))}
+PORT=${4:-9500}
+
+UNLIMITED="-l broadcast=0:1 -l direct=0:1 -l online=0:1 -l ping=0:1 -l other=0:1
+           -L broadcast=0:1 -L direct=0:1 -L online=0:1 -L ping=0:1 -L other=0:1"
+
+SCRIPT=$(mktemp)
+STAT=$(mktemp)
+PERF=""
+if command -v perf > /dev/null 2>&1 &&
+   perf stat -e node-loads,node-load-misses -o /dev/null true > /dev/null 2>&1; then
+  PERF="perf stat -x , -e node-loads,node-load-misses -o $STAT"
+else
+  echo "perf with node-load events is not available, reporting affinity counters only"
+fi
+awk -v n="$COMMANDS" 'BEGIN { for (i = 0; i < n; i++) print "ping " i; print "quit" }' > "$SCRIPT"
+
+run() {
+  label=$1
+  shift
+
+  $PERF ./server $UNLIMITED -S "$@" "$PORT" > /dev/null &
+  server=$!
+  sleep 0.5
+
+  start=$(date +%s%N)
+  bots=""
+  i=0
+  while [ $i -lt "$BOTS" ]; do
+    ./client -a 127.0.0.1 -p "$PORT" -u "bot$i" -f "$SCRIPT" > /dev/null &
+    bots="$bots $!"
+    i=$((i + 1))
+  done
+  for bot in $bots; do
+    wait "$bot"
+  done
+  end=$(date +%s%N)
+
+  affinity=$(printf 'stats\n' | ./client -a 127.0.0.1 -p "$PORT" -u bench -f - |
+             sed -n 's/.*\\naffinity: \([^"]*\)".*/\1/p')
+  # perf stat writes its counters once the server it runs has exited
+  target=$server
+  if [ -n "$PERF" ]; then
+    target=$(cat /proc/"$server"/task/"$server"/children)
+  fi
+  kill $target
+  wait "$server" 2> /dev/null
+
+  total=$((BOTS * (COMMANDS + 1)))
+  printf '%-10s %9d commands/s   %s\n' "$label" \
+    $((total * 1000000 / ((end - start) / 1000))) "$affinity"
+  if [ -n "$PERF" ]; then
+    awk -F , '$3 ~ /^node-load/ { printf "%12s %s %s\n", "", $3, $1 }' "$STAT"
+  fi
+  PORT=$((PORT + 1))
+}
+
+run floating
+run pinned -A "${CPUS%%[-,]*}" -c "$CPUS"
+
+rm -f "$SCRIPT" "$STAT"
@@ -0,0 +1,187 @@
+/*
+ * Microbenchmarks for the rio layer and the server's command handling.
+ * server.c is compiled into this program with its main renamed, so the
+ * benchmarks call the same parseCommand, classifyCommand and formatMessage
+ * the server runs.
+ *
+ * Usage: bench [seconds per benchmark]
+ */
+
+#define main serverMain
+#include "../server.c"
+#undef main
+
+#define STREAM_SIZE (64 << 20) // Bytes pushed through the socketpair per read benchmark
+
+const char *sampleCommands[] = {
+    "msg \"hello everyone, how is it going?\"",
+    "msg \"are you there?\" alice",
+    "online",
+    "ping 1234567890",
+    "msg \"a somewhat longer message that carries a full sentence of chat text\" bob",
+    "help",
+};
+#define SAMPLE_COUNT (sizeof(sampleCommands) / sizeof(sampleCommands[0]))
+
+double benchSeconds = 1.0;
+volatile long sink; // Keeps results alive so the compiler cannot drop the work
+
+// Read the monotonic clock in seconds
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Print one result line
+void report(const char *name, long ops, long bytes, double elapsed) {
+  printf("%-22s %12.0f ops/s %9.1f ns/op", name, ops / elapsed, elapsed * 1e9 / ops);
+  if (bytes > 0)
+    printf(" %9.1f MB/s", bytes / elapsed / 1e6);
+  printf("\n");
+}
+
+// Writer side of a read benchmark
+struct Writer {
+  int fd;
+  const char *data;
+  size_t size;
+  size_t fragment; // Largest write, 0 to write the whole buffer at once
+};
+
+// Function for a thread writing the benchmark stream in fragments
+void *writeStream(void *vargp) {
+  struct Writer *writer = vargp;
+  size_t offset = 0, count;
+  unsigned seed = 1;
+
+  while (offset < writer->size) {
+    count = writer->size - offset;
+    if (writer->fragment > 0) {
+      // Vary fragment sizes so reads split lines at every position
+      count = 1 + rand_r(&seed) % writer->fragment;
+      if (count > writer->size - offset)
+        count = writer->size - offset;
+    }
+    if (rio_writen(writer->fd, writer->data + offset, count) == -1)
+      break;
+    offset += count;
+  }
+  shutdown(writer->fd, SHUT_WR);
+  return NULL;
+}
+
+// Build a stream of newline terminated chat commands
+char *buildLines(size_t size) {
+  char *data = malloc(size);
+  size_t offset = 0, length;
+  int i = 0;
+
+  while (offset < size) {
+    length = strlen(sampleCommands[i % SAMPLE_COUNT]);
+    if (offset + length + 1 > size)
+      length = size - offset - 1;
+    memcpy(data + offset, sampleCommands[i++ % SAMPLE_COUNT], length);
+    data[offset + length] = '\n';
+    offset += length + 1;
+  }
+  return data;
+}
+
+/*
+ * Stream data through a socketpair and read it back with rio.
+ *
+ * @param name: Benchmark name
+ * @param fragment: Largest write on the sending side, 0 for whole buffer writes
+ * @param lines: Read with rio_readlineb if set, otherwise with rio_readnb
+ */
+void benchRead(const char *name, size_t fragment, int lines) {
+  char buffer[BUFFER_SIZE];
+  struct Writer writer;
+  pthread_t tid;
+  int fds[2];
+  long ops = 0, bytes = 0;
+  ssize_t count;
+  rio_t rio;
+  double start;
+  char *data = buildLines(fragment ? STREAM_SIZE / 16 : STREAM_SIZE);
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    perror("socketpair failed");
+    exit(EXIT_FAILURE);
+  }
+  writer.fd = fds[1];
+  writer.data = data;
+  writer.size = fragment ? STREAM_SIZE / 16 : STREAM_SIZE;
+  writer.fragment = fragment;
+
+  rio_readinitb(&rio, fds[0]);
+  start = now();
+  pthread_create(&tid, NULL, writeStream, &writer);
+  while ((count = lines ? rio_readlineb(&rio, buffer, BUFFER_SIZE)
+                        : rio_readnb(&rio, buffer, sizeof(buffer))) > 0) {
+    ops++;
+    bytes += count;
+  }
+  report(name, ops, bytes, now() - start);
+
+  pthread_join(tid, NULL);
+  close(fds[0]);
+  close(fds[1]);
+  free(data);
+}
+
+// Measure parseCommand on the sample commands
+void benchParse(void) {
+  char keyword[BUFFER_SIZE], message[BUFFER_SIZE], receiver[BUFFER_SIZE];
+  long ops = 0;
+  double start = now(), elapsed;
+
+  do {
+    for (int i = 0; i < 1000; i++, ops++) {
+      parseCommand(sampleCommands[ops % SAMPLE_COUNT], keyword, message, receiver);
+      sink += message[0];
+    }
+  } while ((elapsed = now() - start) < benchSeconds);
+  report("parseCommand", ops, 0, elapsed);
+}
+
+// Measure classifyCommand, which runs on every line before rate limiting
+void benchClassify(void) {
+  long ops = 0;
+  double start = now(), elapsed;
+
+  do {
+    for (int i = 0; i < 1000; i++, ops++)
+      sink += classifyCommand(sampleCommands[ops % SAMPLE_COUNT]);
+  } while ((elapsed = now() - start) < benchSeconds);
+  report("classifyCommand", ops, 0, elapsed);
+}
+
+// Measure formatMessage, which builds every chat frame
+void benchFormat(void) {
+  char response[BUFFER_SIZE], message[BUFFER_SIZE], sender[] = "alice";
+  long ops = 0, bytes = 0;
+  double start = now(), elapsed;
+
+  strcpy(message, "a somewhat longer message that carries a full sentence of chat text");
+  do {
+    for (int i = 0; i < 1000; i++, ops++)
+      bytes += formatMessage(response, message, sender);
+  } while ((elapsed = now() - start) < benchSeconds);
+  report("formatMessage", ops, bytes, elapsed);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    benchSeconds = atof(argv[1]);
+
+  benchRead("rio_readlineb", 0, 1);
+  benchRead("rio_readlineb/frag", 7, 1);
+  benchRead("rio_readnb", 0, 0);
+  benchRead("rio_readnb/frag", 7, 0);
+  benchParse();
+  benchClassify();
+  benchFormat();
+  return 0;
+}
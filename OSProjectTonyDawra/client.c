@@ -1,19 +1,42 @@
+#define _GNU_SOURCE // getline
 #include "functions.h"
 #include "helper.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MAXLINE 1024 /* Maximum line size for messages */
+#define SERVER_MAXLINE 998 /* Longest command the server reads in one line, without the newline */
+
+#define HEADLESS_BUFSIZE 65536  /* Size of each buffer used in headless mode */
+#define HEADLESS_WINDOW 1024    /* Default number of commands in flight in headless mode */
+#define HEADLESS_DRAIN_MS 5000  /* Idle time allowed for outstanding replies after the script ends */
+
+#define PROBE_BUCKETS 28        /* Power of two microsecond buckets in the probe histogram */
+#define PROBE_INTERVAL_MS 100   /* Default time between latency probes */
+#define PROBE_TIMEOUT_MS 1000   /* Time after which a probe is counted as lost */
+#define PROBE_REPORT_EVERY 100  /* Probes between histograms in continuous mode */
 
 char chatPrompt[] = "Chatroom> ";
 
+// Incoming stream state, only touched by the server response reader
+int incomingFd = -1;               // Destination of the stream, STDOUT_FILENO for long messages
+long long incomingLeft = 0;        // Bytes still expected
+char incomingPath[MAXLINE];        // File this stream created, empty if none
+
 /*
  * Display usage information for the script
  */
@@ -22,6 +45,10 @@ void displayUsage() {
   printf("-a  Server IP address [Required]\n");
   printf("-p  Server port number [Required]\n");
   printf("-u  Enter your username [Required]\n");
+  printf("-f  Run headless, reading commands from a file ('-' for stdin)\n");
+  printf("-w  Maximum commands in flight in headless mode (default %d)\n", HEADLESS_WINDOW);
+  printf("-P  Run count latency probes and print a histogram (0 runs until interrupted)\n");
+  printf("-i  Milliseconds between latency probes (default %d)\n", PROBE_INTERVAL_MS);
 }
 
 /*
@@ -81,6 +108,737 @@ int connectToServer(char *serverAddress, char *serverPort) {
   }
 }
 
+/*
+ * Format the header announcing a stream to the server.
+ *
+ * @param header: Buffer for the header
+ * @param capacity: Size of the buffer
+ * @param receiver: Username of the receiver
+ * @param size: Number of payload bytes that follow
+ * @param name: File name, or "-" for a long message
+ * @return: Length of the header, or -1 if the server could not read it as one line
+ */
+int formatStreamHeader(char *header, size_t capacity, char *receiver, long long size, char *name) {
+  int length = snprintf(header, capacity, "send %s %lld %s\n", receiver, size, name);
+
+  // A split header would turn its tail into payload and the payload's end into commands
+  if (length < 0 || (size_t)length >= capacity || length - 1 > SERVER_MAXLINE)
+    return -1;
+  return length;
+}
+
+/*
+ * Send a file to a specific client as a stream, without copying it through user space.
+ *
+ * @param connectionSocket: Connection file descriptor
+ * @param command: User command of the form "send file user"
+ */
+void sendFile(int connectionSocket, char *command) {
+  char path[MAXLINE], receiver[MAXLINE], header[3 * MAXLINE];
+  struct stat fileStat;
+  off_t offset = 0;
+  ssize_t sent;
+  char *name;
+  int fileFd, headerLength;
+
+  if (sscanf(command, "send %1023s %1023s", path, receiver) != 2) {
+    printf("Usage: send file user\n%s", chatPrompt);
+    fflush(stdout);
+    return;
+  }
+
+  if ((fileFd = open(path, O_RDONLY)) == -1 || fstat(fileFd, &fileStat) == -1) {
+    perror("Error: Unable to open the file");
+    if (fileFd != -1)
+      close(fileFd);
+    printf("%s", chatPrompt);
+    fflush(stdout);
+    return;
+  }
+
+  // Only regular files have a known size that sendfile can stream
+  if (!S_ISREG(fileStat.st_mode)) {
+    printf("Error: %s is not a regular file\n%s", path, chatPrompt);
+    fflush(stdout);
+    close(fileFd);
+    return;
+  }
+
+  // Announce the stream, then hand the file contents straight to the socket
+  name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+  headerLength = formatStreamHeader(header, sizeof(header), receiver,
+                                    (long long)fileStat.st_size, name);
+  if (headerLength == -1) {
+    printf("Error: Receiver and file name are too long\n%s", chatPrompt);
+    fflush(stdout);
+    close(fileFd);
+    return;
+  }
+  if (rio_writen(connectionSocket, header, headerLength) == -1) {
+    perror("Error: Unable to send the data");
+    close(connectionSocket);
+    exit(1);
+  }
+
+  while (offset < fileStat.st_size) {
+    if ((sent = sendfile(connectionSocket, fileFd, &offset, fileStat.st_size - offset)) <= 0) {
+      if (sent < 0 && errno == EINTR)
+        continue; // Retry if sendfile was interrupted
+      perror("Error: Unable to send the file");
+      close(connectionSocket);
+      exit(1);
+    }
+  }
+
+  close(fileFd);
+}
+
+/*
+ * Send a message longer than the server's line limit to a specific client as a stream.
+ *
+ * @param connectionSocket: Connection file descriptor
+ * @param command: User command of the form msg "text" user
+ */
+void sendLongMessage(int connectionSocket, char *command) {
+  char header[2 * MAXLINE], receiver[MAXLINE];
+  char *start = strchr(command, '"');
+  char *end = strrchr(command, '"');
+  int headerLength;
+
+  receiver[0] = '\0';
+  if (start == NULL || end == start || sscanf(end + 1, "%1023s", receiver) != 1) {
+    printf("Error: Messages longer than %d bytes need a receiver\n%s", SERVER_MAXLINE, chatPrompt);
+    fflush(stdout);
+    return;
+  }
+
+  start++;
+  if ((headerLength = formatStreamHeader(header, sizeof(header), receiver, end - start, "-")) == -1) {
+    printf("Error: Receiver name is too long\n%s", chatPrompt);
+    fflush(stdout);
+    return;
+  }
+  if (rio_writen(connectionSocket, header, headerLength) == -1 ||
+      rio_writen(connectionSocket, start, end - start) == -1) {
+    perror("Error: Unable to send the data");
+    close(connectionSocket);
+    exit(1);
+  }
+}
+
+/*
+ * Start receiving a stream announced by "file sender size name".
+ * A name of "-" marks a long message, which is printed instead of saved.
+ */
+void startIncoming(char *header) {
+  char sender[MAXLINE], name[MAXLINE];
+  char *base;
+
+  if (incomingFd != -1 && incomingFd != STDOUT_FILENO)
+    close(incomingFd);
+  incomingFd = -1;
+  incomingPath[0] = '\0';
+
+  if (sscanf(header, "file %1023s %lld %1023[^\n]", sender, &incomingLeft, name) != 3) {
+    incomingLeft = 0;
+    return;
+  }
+
+  if (!strcmp(name, "-")) {
+    printf("\n%s:", sender);
+    fflush(stdout);
+    incomingFd = STDOUT_FILENO;
+  } else {
+    // Never let the sender choose a path outside the working directory
+    base = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+    if (snprintf(incomingPath, sizeof(incomingPath), "received-%s-%s", sender, base) >=
+        (int)sizeof(incomingPath)) {
+      // A truncated name could overwrite another file, so the stream is discarded instead
+      printf("\nError: Name of the received file is too long\n");
+      incomingPath[0] = '\0';
+    } else if ((incomingFd = open(incomingPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+      perror("Error: Unable to save the file");
+      incomingPath[0] = '\0';
+    }
+    printf("\nReceiving %s (%lld bytes) from %s\n", base, incomingLeft, sender);
+  }
+}
+
+// Finish the current incoming stream, removing the partial file it created when it was aborted
+void finishIncoming(int aborted) {
+  if (incomingFd == STDOUT_FILENO) {
+    printf(aborted ? " [message truncated]\n" : "\n");
+  } else {
+    if (incomingFd != -1)
+      close(incomingFd);
+    if (aborted) {
+      if (incomingPath[0] != '\0')
+        unlink(incomingPath);
+      printf("\nFile transfer aborted\n");
+    } else if (incomingPath[0] != '\0') {
+      printf("\nFile saved as %s\n", incomingPath);
+    } else {
+      printf("\nReceived file discarded\n");
+    }
+  }
+  incomingFd = -1;
+  incomingLeft = 0;
+  incomingPath[0] = '\0';
+  printf("%s", chatPrompt);
+  fflush(stdout);
+}
+
+/*
+ * Copy one "chunk n" frame of the incoming stream to its destination.
+ *
+ * @param rp: Pointer to the Rio buffer of the connection
+ * @param n: Number of bytes in the chunk
+ * @return: 0 on success, -1 if the connection failed
+ */
+int receiveChunk(rio_t *rp, long long n) {
+  char buffer[RIO_BUFSIZE];
+  ssize_t count;
+
+  while (n > 0) {
+    count = n < (long long)sizeof(buffer) ? n : (long long)sizeof(buffer);
+    if ((count = rio_readnb(rp, buffer, count)) <= 0)
+      return -1;
+    if (incomingFd != -1 && rio_writen(incomingFd, buffer, count) == -1) {
+      perror("Error: Unable to write the stream");
+      if (incomingFd != STDOUT_FILENO)
+        close(incomingFd);
+      incomingFd = -1;
+    }
+    n -= count;
+    incomingLeft -= count;
+  }
+
+  if (incomingLeft <= 0)
+    finishIncoming(0);
+  return 0;
+}
+
+// State of the single threaded headless mode
+struct Headless {
+  int connectionSocket;
+  int inputFd;
+  int inputDone;
+  char input[HEADLESS_BUFSIZE];  // Script bytes not yet queued
+  size_t inputLen;
+  char output[HEADLESS_BUFSIZE]; // Queued commands, sent from outputSent onwards
+  size_t outputLen, outputSent;
+  size_t pending;                // Complete commands queued but not yet sent
+  char received[HEADLESS_BUFSIZE]; // Server bytes not yet parsed
+  size_t receivedLen;
+  char frame[HEADLESS_BUFSIZE];  // Lines of the response being assembled
+  size_t frameLen;
+  int inMessage;                 // Set when the frame is a message from another client
+  long long skip;                // Raw stream bytes still to be skipped
+  long long *sentAt;             // Ring of send times of commands awaiting a reply
+  size_t window, head, inFlight;
+  unsigned long sent, replies, dropped, timed, messages, errors;
+  long long latencyMin, latencyMax, latencySum;
+  long long start, lastActivity;
+};
+
+// Read the monotonic clock in microseconds
+long long monotonicMicros(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Read the wall clock in microseconds since the epoch
+long long wallMicros(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Start a structured output record of the given type
+void recordStart(const char *type) {
+  printf("{\"ts\":%lld,\"type\":\"%s\"", wallMicros(), type);
+}
+
+// Add an escaped string field to the current record
+void recordText(const char *key, const char *text, size_t length) {
+  printf(",\"%s\":\"", key);
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)text[i];
+    if (c == '"' || c == '\\')
+      printf("\\%c", c);
+    else if (c == '\n')
+      printf("\\n");
+    else if (c < 0x20)
+      printf("\\u%04x", c);
+    else
+      putchar(c);
+  }
+  putchar('"');
+}
+
+// Finish the current record
+void recordEnd(void) {
+  printf("}\n");
+}
+
+// Report a script line that was not sent
+void recordError(struct Headless *bot, const char *reason, const char *line, size_t length) {
+  bot->errors++;
+  recordStart("error");
+  recordText("reason", reason, strlen(reason));
+  recordText("line", line, length);
+  recordEnd();
+}
+
+// Move complete script lines into the output buffer while the window allows it
+void queueCommands(struct Headless *bot) {
+  size_t used = 0, length;
+  char *line, *newline;
+
+  // A final line without a newline is completed once the script ends
+  if (bot->inputDone && bot->inputLen > 0 && bot->input[bot->inputLen - 1] != '\n' &&
+      bot->inputLen < sizeof(bot->input))
+    bot->input[bot->inputLen++] = '\n';
+
+  while (used < bot->inputLen && bot->inFlight + bot->pending < bot->window) {
+    line = bot->input + used;
+    if ((newline = memchr(line, '\n', bot->inputLen - used)) == NULL) {
+      if (bot->inputLen - used == sizeof(bot->input)) {
+        recordError(bot, "line too long", line, MAXLINE);
+        used = bot->inputLen; // Drop the oversized line
+      }
+      break;
+    }
+    length = (size_t)(newline - line) + 1;
+
+    if (length - 1 > SERVER_MAXLINE) {
+      recordError(bot, "line too long", line, SERVER_MAXLINE);
+    } else if (!strncmp(line, "send ", 5)) {
+      recordError(bot, "streams are not supported in headless mode", line, length - 1);
+    } else {
+      if (bot->outputLen + length > sizeof(bot->output)) {
+        // Reclaim space already sent before giving up on this round
+        memmove(bot->output, bot->output + bot->outputSent, bot->outputLen - bot->outputSent);
+        bot->outputLen -= bot->outputSent;
+        bot->outputSent = 0;
+        if (bot->outputLen + length > sizeof(bot->output))
+          break;
+      }
+      memcpy(bot->output + bot->outputLen, line, length);
+      bot->outputLen += length;
+      bot->pending++;
+    }
+    used += length;
+  }
+
+  memmove(bot->input, bot->input + used, bot->inputLen - used);
+  bot->inputLen -= used;
+}
+
+// Send queued commands without blocking and start their latency clocks
+int flushCommands(struct Headless *bot) {
+  ssize_t count;
+  long long now;
+  char *cursor, *end, *newline;
+
+  count = send(bot->connectionSocket, bot->output + bot->outputSent,
+               bot->outputLen - bot->outputSent, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (count < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+  // Every newline written completes one command
+  now = monotonicMicros();
+  cursor = bot->output + bot->outputSent;
+  end = cursor + count;
+  while ((newline = memchr(cursor, '\n', end - cursor)) != NULL) {
+    bot->sentAt[(bot->head + bot->inFlight) % bot->window] = now;
+    bot->inFlight++;
+    bot->pending--;
+    bot->sent++;
+    cursor = newline + 1;
+  }
+
+  bot->outputSent += count;
+  bot->lastActivity = now;
+  if (bot->outputSent == bot->outputLen)
+    bot->outputLen = bot->outputSent = 0;
+  return 0;
+}
+
+// Emit the reply record for the oldest command in flight
+void recordReply(struct Headless *bot, const char *text, size_t length) {
+  const char notice[] = "Rate limit exceeded, command dropped";
+  long long latency = -1;
+  // A command dropped by the rate limiter is answered by a notice, which is kept out of the latencies
+  int dropped = length == sizeof(notice) - 1 && !memcmp(text, notice, length);
+
+  if (bot->inFlight > 0) {
+    latency = monotonicMicros() - bot->sentAt[bot->head];
+    bot->head = (bot->head + 1) % bot->window;
+    bot->inFlight--;
+    if (!dropped) {
+      if (bot->timed++ == 0 || latency < bot->latencyMin)
+        bot->latencyMin = latency;
+      if (latency > bot->latencyMax)
+        bot->latencyMax = latency;
+      bot->latencySum += latency;
+    }
+  }
+  if (dropped)
+    bot->dropped++;
+  else
+    bot->replies++;
+
+  recordStart(dropped ? "dropped" : "reply");
+  printf(",\"seq\":%lu,\"latency_us\":%lld", bot->replies + bot->dropped, latency);
+  recordText("text", text, length);
+  recordEnd();
+}
+
+// Emit a record for one complete response frame
+void recordFrame(struct Headless *bot) {
+  size_t length = bot->frameLen;
+  char *colon;
+
+  // Drop the newline that ends the last line of the frame
+  if (length > 0 && bot->frame[length - 1] == '\n')
+    length--;
+
+  if (bot->inMessage) {
+    bot->messages++;
+    colon = memchr(bot->frame, ':', length);
+    recordStart("message");
+    if (colon != NULL) {
+      recordText("from", bot->frame, colon - bot->frame);
+      recordText("text", colon + 1, length - (colon - bot->frame) - 1);
+    } else {
+      recordText("text", bot->frame, length);
+    }
+    recordEnd();
+  } else {
+    recordReply(bot, bot->frame, length);
+  }
+
+  bot->frameLen = 0;
+  bot->inMessage = 0;
+}
+
+// Parse the server bytes received so far into records
+void parseResponses(struct Headless *bot) {
+  size_t used = 0, length, count;
+  char *line, *newline;
+
+  while (used < bot->receivedLen) {
+    // Skip the raw bytes of streams, which headless mode does not save
+    if (bot->skip > 0) {
+      count = bot->receivedLen - used;
+      if ((long long)count > bot->skip)
+        count = (size_t)bot->skip;
+      bot->skip -= count;
+      used += count;
+      continue;
+    }
+
+    line = bot->received + used;
+    if ((newline = memchr(line, '\n', bot->receivedLen - used)) == NULL)
+      break;
+    length = (size_t)(newline - line) + 1;
+    used += length;
+
+    if (length == 2 && line[0] == '\r') {
+      recordFrame(bot);
+    } else if (bot->frameLen == 0 && !bot->inMessage && length == 6 && !strncmp(line, "start\n", 6)) {
+      bot->inMessage = 1;
+    } else if (bot->frameLen == 0 && !bot->inMessage && !strncmp(line, "chunk ", 6)) {
+      bot->skip = atoll(line + 6);
+    } else if (bot->frameLen == 0 && !bot->inMessage &&
+               (!strncmp(line, "file ", 5) || !strncmp(line, "abort\n", 6))) {
+      recordStart(line[0] == 'f' ? "stream" : "abort");
+      recordText("text", line, length - 1);
+      recordEnd();
+    } else if (bot->frameLen + length <= sizeof(bot->frame)) {
+      memcpy(bot->frame + bot->frameLen, line, length);
+      bot->frameLen += length;
+    }
+  }
+
+  memmove(bot->received, bot->received + used, bot->receivedLen - used);
+  bot->receivedLen -= used;
+}
+
+// Emit the closing summary record
+void recordSummary(struct Headless *bot) {
+  long long elapsed = monotonicMicros() - bot->start;
+
+  recordStart("summary");
+  printf(",\"sent\":%lu,\"replies\":%lu,\"dropped\":%lu,\"messages\":%lu,\"errors\":%lu",
+         bot->sent, bot->replies, bot->dropped, bot->messages, bot->errors);
+  printf(",\"outstanding\":%zu", bot->inFlight);
+  printf(",\"elapsed_us\":%lld,\"commands_per_sec\":%.1f", elapsed,
+         elapsed > 0 ? bot->sent * 1e6 / elapsed : 0.0);
+  printf(",\"latency_min_us\":%lld,\"latency_avg_us\":%lld,\"latency_max_us\":%lld",
+         bot->latencyMin, bot->timed > 0 ? bot->latencySum / (long long)bot->timed : 0,
+         bot->latencyMax);
+  recordEnd();
+}
+
+/*
+ * Run the client without threads: commands from a script are pipelined to the
+ * server up to window commands ahead of their replies, and every reply, message
+ * and error is written to stdout as one JSON record per line.
+ *
+ * @param connectionSocket: Connection file descriptor
+ * @param inputFd: File descriptor of the script
+ * @param window: Maximum commands in flight
+ * @return: 0 if every command was answered, 1 otherwise
+ */
+int runHeadless(int connectionSocket, int inputFd, size_t window) {
+  struct Headless *bot = calloc(1, sizeof(struct Headless));
+  struct pollfd fds[2];
+  ssize_t count;
+  int timeout, status;
+
+  if (bot == NULL || (bot->sentAt = malloc(window * sizeof(long long))) == NULL) {
+    perror("Memory allocation error");
+    return 1;
+  }
+  bot->connectionSocket = connectionSocket;
+  bot->inputFd = inputFd;
+  bot->window = window;
+  bot->start = bot->lastActivity = monotonicMicros();
+
+  // Records are written in bulk and flushed whenever the loop would wait
+  setvbuf(stdout, NULL, _IOFBF, HEADLESS_BUFSIZE);
+
+  while (1) {
+    queueCommands(bot);
+
+    // Stop once the script is done and every command has been answered
+    if (bot->inputDone && bot->inputLen == 0 && bot->outputLen == 0 && bot->inFlight == 0)
+      break;
+
+    // Give up on replies that stop arriving while nothing else can make progress
+    timeout = -1;
+    if (bot->outputLen == 0 && bot->inFlight > 0 &&
+        (bot->inputDone || bot->inFlight >= bot->window)) {
+      timeout = (int)(HEADLESS_DRAIN_MS - (monotonicMicros() - bot->lastActivity) / 1000);
+      if (timeout <= 0)
+        break;
+    }
+
+    fds[0].fd = connectionSocket;
+    fds[0].events = POLLIN | (bot->outputLen > bot->outputSent ? POLLOUT : 0);
+    fds[1].fd = bot->inputDone || bot->inputLen == sizeof(bot->input) ? -1 : inputFd;
+    fds[1].events = POLLIN;
+
+    fflush(stdout);
+    if (poll(fds, 2, timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("Error: poll failed");
+      break;
+    }
+
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      count = read(inputFd, bot->input + bot->inputLen, sizeof(bot->input) - bot->inputLen);
+      if (count > 0)
+        bot->inputLen += count;
+      else if (count == 0 || errno != EINTR)
+        bot->inputDone = 1;
+    }
+
+    if ((fds[0].revents & POLLOUT) && flushCommands(bot) == -1) {
+      perror("Error: Unable to send the data");
+      break;
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      count = recv(connectionSocket, bot->received + bot->receivedLen,
+                   sizeof(bot->received) - bot->receivedLen, MSG_DONTWAIT);
+      if (count == 0 || (count < 0 && errno != EAGAIN && errno != EINTR)) {
+        // The server answers "quit" with "exit" and closes the connection
+        if (bot->receivedLen == 4 && !strncmp(bot->received, "exit", 4))
+          recordReply(bot, bot->received, 4);
+        break;
+      }
+      if (count > 0) {
+        bot->receivedLen += count;
+        bot->lastActivity = monotonicMicros();
+        parseResponses(bot);
+      }
+    }
+  }
+
+  recordSummary(bot);
+  fflush(stdout);
+
+  status = bot->inFlight > 0 || bot->pending > 0 || bot->inputLen > 0;
+  free(bot->sentAt);
+  free(bot);
+  return status;
+}
+
+// Latency samples of one component of the round trip
+struct LatencySeries {
+  const char *name;
+  unsigned long buckets[PROBE_BUCKETS]; // Bucket i > 0 holds samples in [2^(i-1), 2^i) us
+  unsigned long count;
+  long long min, max, sum;
+};
+
+volatile sig_atomic_t probeStopped = 0;
+
+// Signal handler that ends a continuous probe run
+void stopProbe(int signal) {
+  probeStopped = 1;
+}
+
+// Add a sample in microseconds to a latency series
+void addSample(struct LatencySeries *series, long long micros) {
+  int bucket = 0;
+
+  if (micros < 0)
+    micros = 0;
+  while (bucket < PROBE_BUCKETS - 1 && micros >= (1LL << bucket))
+    bucket++;
+
+  series->buckets[bucket]++;
+  if (series->count++ == 0 || micros < series->min)
+    series->min = micros;
+  if (micros > series->max)
+    series->max = micros;
+  series->sum += micros;
+}
+
+// Upper bound in microseconds of the bucket holding the given percentile
+long long percentile(struct LatencySeries *series, double fraction) {
+  unsigned long seen = 0, target = (unsigned long)(series->count * fraction);
+
+  for (int bucket = 0; bucket < PROBE_BUCKETS; bucket++) {
+    seen += series->buckets[bucket];
+    if (seen > target)
+      return 1LL << bucket;
+  }
+  return series->max;
+}
+
+// Print summaries and a side by side histogram of the latency series
+void printHistogram(struct LatencySeries *series, int seriesCount, unsigned long lost) {
+  int first = PROBE_BUCKETS, last = -1;
+
+  printf("\nprobes %lu lost %lu\n", series[0].count, lost);
+  for (int i = 0; i < seriesCount; i++) {
+    printf("%-10s min %lld avg %lld p50 <%lld p99 <%lld max %lld us\n", series[i].name,
+           series[i].min, series[i].count ? series[i].sum / (long long)series[i].count : 0,
+           percentile(&series[i], 0.5), percentile(&series[i], 0.99), series[i].max);
+    for (int bucket = 0; bucket < PROBE_BUCKETS; bucket++) {
+      if (series[i].buckets[bucket] == 0)
+        continue;
+      if (bucket < first)
+        first = bucket;
+      if (bucket > last)
+        last = bucket;
+    }
+  }
+
+  printf("%-18s", "us");
+  for (int i = 0; i < seriesCount; i++)
+    printf("%10s", series[i].name);
+  printf("\n");
+  for (int bucket = first; bucket <= last; bucket++) {
+    printf("[%7lld, %7lld)", bucket ? 1LL << (bucket - 1) : 0, 1LL << bucket);
+    for (int i = 0; i < seriesCount; i++)
+      printf("%10lu", series[i].buckets[bucket]);
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+// Wait until the connection has buffered or incoming data, returns 0 on timeout
+int waitReadable(rio_t *rp, int timeoutMs) {
+  struct pollfd fd = {rp->rio_fd, POLLIN, 0};
+
+  if (rp->rio_cnt > 0)
+    return 1;
+  while (poll(&fd, 1, timeoutMs) == -1) {
+    if (errno != EINTR || probeStopped)
+      return 0;
+  }
+  return fd.revents != 0;
+}
+
+/*
+ * Measure round trips with the ping command. The server reports when it read and
+ * dispatched each ping and when it was about to write the reply, on its monotonic
+ * clock, which splits every round trip into queueing (receive to dispatch, covering
+ * rate limiting and the global mutex), server time (receive to pre-write) and
+ * transport (the rest, including the server's write system call).
+ *
+ * @param connectionSocket: Connection file descriptor
+ * @param count: Number of probes, 0 to run until interrupted
+ * @param intervalMs: Milliseconds between probes
+ * @return: 0 if any probe was answered, 1 otherwise
+ */
+int runProbe(int connectionSocket, long count, long intervalMs) {
+  struct LatencySeries series[4] = {{"rtt"}, {"queue"}, {"server"}, {"transport"}};
+  char buffer[MAXLINE], token[MAXLINE];
+  long long sentAt, rtt, receivedNs, dispatchNs, writeNs, pause;
+  unsigned long lost = 0;
+  struct timespec delay;
+  rio_t rio;
+  int answered;
+
+  rio_readinitb(&rio, connectionSocket);
+  signal(SIGINT, stopProbe);
+
+  for (long probe = 0; (count == 0 || probe < count) && !probeStopped; probe++) {
+    sentAt = monotonicMicros();
+    sprintf(buffer, "ping %lld\n", sentAt);
+    if (rio_writen(connectionSocket, buffer, strlen(buffer)) == -1) {
+      perror("Error: Unable to send the data");
+      break;
+    }
+
+    // Skip messages from other clients until the matching pong arrives
+    answered = 0;
+    while (!answered && waitReadable(&rio, PROBE_TIMEOUT_MS)) {
+      if (rio_readlineb(&rio, buffer, MAXLINE) <= 0) {
+        probeStopped = 1;
+        break;
+      }
+      if (!strncmp(buffer, "chunk ", 6)) {
+        for (long long left = atoll(buffer + 6); left > 0; left -= MAXLINE)
+          rio_readnb(&rio, buffer, left < MAXLINE ? left : MAXLINE);
+      } else if (sscanf(buffer, "pong %1023s %lld %lld %lld", token, &receivedNs, &dispatchNs,
+                        &writeNs) == 4 && atoll(token) == sentAt) {
+        rtt = monotonicMicros() - sentAt;
+        addSample(&series[0], rtt);
+        addSample(&series[1], (dispatchNs - receivedNs) / 1000);
+        addSample(&series[2], (writeNs - receivedNs) / 1000);
+        addSample(&series[3], rtt - (writeNs - receivedNs) / 1000);
+        answered = 1;
+      }
+    }
+    if (!answered)
+      lost++;
+
+    if (count == 0 && (probe + 1) % PROBE_REPORT_EVERY == 0)
+      printHistogram(series, 4, lost);
+
+    // Keep probes evenly spaced regardless of how long the reply took
+    pause = intervalMs * 1000 - (monotonicMicros() - sentAt);
+    if (pause > 0 && !probeStopped) {
+      delay.tv_sec = pause / 1000000;
+      delay.tv_nsec = (pause % 1000000) * 1000;
+      nanosleep(&delay, NULL);
+    }
+  }
+
+  printHistogram(series, 4, lost);
+  return series[0].count == 0;
+}
+
 /*
  * Function for a separate thread to read and display server responses
  */
@@ -88,6 +846,7 @@ void serverResponseReader(void *socketDescriptor) {
   char buffer[MAXLINE];
   rio_t rio;
   int readStatus;
+  int frameStart = 1; // Set while no line of a reply or message has been read
   int connectionSocket = (int)socketDescriptor;
 
   // Initialize the Rio buffer for reading from the socket
@@ -102,6 +861,7 @@ void serverResponseReader(void *socketDescriptor) {
 
       // Break the loop when an empty line is received
       if (!strcmp(buffer, "\r\n")) {
+        frameStart = 1;
         break;
       }
 
@@ -111,6 +871,27 @@ void serverResponseReader(void *socketDescriptor) {
         exit(0);
       }
 
+      // Stream frames carry raw bytes and bypass the line protocol. They are only sent
+      // between frames, so lines inside a reply, such as usernames, are never taken for them
+      if (frameStart && !strncmp(buffer, "file ", 5)) {
+        fflush(stdout);
+        startIncoming(buffer);
+        if (incomingLeft == 0)
+          finishIncoming(0);
+        continue;
+      }
+      if (frameStart && incomingLeft > 0 && !strncmp(buffer, "chunk ", 6)) {
+        fflush(stdout);
+        if (receiveChunk(&rio, atoll(buffer + 6)) == -1)
+          exit(1);
+        continue;
+      }
+      if (frameStart && incomingLeft > 0 && !strcmp(buffer, "abort\n")) {
+        finishIncoming(1);
+        continue;
+      }
+      frameStart = 0;
+
       // Display received messages, handling special case for "start"
       if (!strcmp(buffer, "start\n")) {
         printf("\n");
@@ -119,6 +900,12 @@ void serverResponseReader(void *socketDescriptor) {
       }
     }
     
+    // Stop once the server closes the connection, for example after refusing the username
+    if (readStatus <= 0) {
+      printf("\nConnection closed by the server\n");
+      exit(readStatus < 0);
+    }
+
     // Display the chat prompt after processing server responses
     printf("%s", chatPrompt);
     fflush(stdout);
@@ -129,12 +916,17 @@ int main(int argc, char **argv) {
   char *defaultServerPort = "9000"; // Default server port if not provided
 
   char *serverAddress = NULL, *username = NULL;
-  char userCommand[MAXLINE];
-  char commandOption;
+  char *userCommand = NULL;
+  size_t commandCapacity = 0;
+  ssize_t commandLength;
+  char *scriptPath = NULL;
+  int commandOption;
+  long window = HEADLESS_WINDOW;
+  long probeCount = -1, probeInterval = PROBE_INTERVAL_MS;
   pthread_t responseThread;
 
   // Parse command-line arguments using getopt
-  while ((commandOption = getopt(argc, argv, "hu:a:p:")) != -1) {
+  while ((commandOption = getopt(argc, argv, "hu:a:p:f:w:P:i:")) != -1) {
     switch (commandOption) {
     
     case 'h':
@@ -154,6 +946,22 @@ int main(int argc, char **argv) {
       username = strdup(optarg); // Duplicate and store the username
       break;
 
+    case 'f':
+      scriptPath = optarg; // Run headless from this script
+      break;
+
+    case 'w':
+      window = atol(optarg);
+      break;
+
+    case 'P':
+      probeCount = atol(optarg); // Run latency probes instead of the chat
+      break;
+
+    case 'i':
+      probeInterval = atol(optarg);
+      break;
+
     default:
       displayUsage();
       exit(1);
@@ -161,7 +969,8 @@ int main(int argc, char **argv) {
   }
 
   // Check if required command-line arguments are provided
-  if (optind == 1 || defaultServerPort == NULL || serverAddress == NULL || username == NULL) {
+  if (optind == 1 || defaultServerPort == NULL || serverAddress == NULL || username == NULL ||
+      window < 1 || probeInterval < 0) {
     fprintf(stderr, "Error: Invalid command-line arguments\n");
     displayUsage();
     exit(1);
@@ -182,6 +991,28 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
+  // Probe mode measures latency and exits
+  if (probeCount >= 0) {
+    int status = runProbe(connectionSocket, probeCount, probeInterval);
+    close(connectionSocket);
+    free(username);
+    return status;
+  }
+
+  // Headless mode replaces the prompt and the reader thread with a single poll loop
+  if (scriptPath != NULL) {
+    int scriptFd = strcmp(scriptPath, "-") ? open(scriptPath, O_RDONLY) : STDIN_FILENO;
+    if (scriptFd == -1) {
+      perror("Error: Unable to open the script");
+      close(connectionSocket);
+      exit(1);
+    }
+    int status = runHeadless(connectionSocket, scriptFd, (size_t)window);
+    close(connectionSocket);
+    free(username);
+    return status;
+  }
+
   // Create a separate thread to read and display server responses
   pthread_create(&responseThread, NULL, serverResponseReader, (void *)(intptr_t)connectionSocket);
 
@@ -189,11 +1020,25 @@ int main(int argc, char **argv) {
   printf("%s", chatPrompt);
 
   while (1) {
-    // Read user input and send it to the server
-    if ((fgets(userCommand, MAXLINE, stdin) == NULL) && ferror(stdin)) {
-      perror("Error: fgets error");
-      close(connectionSocket);
-      exit(1);
+    // Read user input of any length and send it to the server
+    if ((commandLength = getline(&userCommand, &commandCapacity, stdin)) == -1) {
+      if (ferror(stdin)) {
+        perror("Error: getline error");
+        close(connectionSocket);
+        exit(1);
+      }
+      break; // End of input
+    }
+
+    // Files and messages that do not fit in a line are sent as streams
+    if (!strncmp(userCommand, "send ", 5)) {
+      sendFile(connectionSocket, userCommand);
+      continue;
+    }
+    if (commandLength - (userCommand[commandLength - 1] == '\n') > SERVER_MAXLINE &&
+        !strncmp(userCommand, "msg", 3)) {
+      sendLongMessage(connectionSocket, userCommand);
+      continue;
     }
 
     // Send the user command to the server
@@ -204,8 +1049,10 @@ int main(int argc, char **argv) {
     }
   }
 
-  // Free allocated memory for the username
+  // Free allocated memory for the username and input line
   free(username);
+  free(userCommand);
+  close(connectionSocket);
 
   return 0;
 }
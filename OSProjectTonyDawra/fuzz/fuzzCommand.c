@@ -0,0 +1,88 @@
+/*
+ * libFuzzer harness for the server's command path.
+ *
+ * The input is what a client sends: a username line followed by commands and
+ * any stream payload. It is queued on a socketpair and read back the way
+ * handleClient does, with every line classified and passed to evaluateCommand.
+ * A second user is online so direct messages and streams have a receiver.
+ * Rate limiting is skipped because it sleeps.
+ */
+
+#define main serverMain
+#include "../server.c"
+#undef main
+
+#define MAX_INPUT 32768 // Stays below the socket buffer so the input can be queued up front
+
+// Function to put a user on the list for one run
+static struct Client *addFuzzUser(char *name, int connection_fd) {
+  struct Client *user = malloc(sizeof(struct Client));
+
+  user->username = strdup(name);
+  user->connection_fd = connection_fd;
+  user->receiving = 0;
+  pthread_mutex_init(&user->write_mutex, NULL);
+  addUser(user);
+  return user;
+}
+
+// Function to make a descriptor non-blocking so full reply buffers cannot stall a run
+static void setNonBlocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static int initialized = 0;
+  char username[BUFFER_SIZE], command[BUFFER_SIZE];
+  struct Client *self, *peerUser;
+  int client[2], peer[2];
+  ssize_t byte_size;
+  rio_t rio;
+
+  if (size > MAX_INPUT)
+    return 0;
+
+  if (!initialized) {
+    pthread_mutex_init(&mutex, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    initialized = 1;
+  }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, client) == -1 ||
+      socketpair(AF_UNIX, SOCK_STREAM, 0, peer) == -1)
+    abort();
+  if (rio_writen(client[1], data, size) != (ssize_t)size)
+    abort();
+  shutdown(client[1], SHUT_WR);
+  setNonBlocking(client[0]);
+  setNonBlocking(peer[0]);
+
+  // Read the username the same way handleClient does
+  rio_readinitb(&rio, client[0]);
+  if ((byte_size = rio_readlineb(&rio, username, BUFFER_SIZE)) > 0)
+    username[byte_size - 1] = '\0';
+  if (byte_size > 0 && validUsername(username)) {
+    peerUser = addFuzzUser("peer", peer[0]);
+    self = addFuzzUser(username, client[0]);
+
+    while ((byte_size = rio_readlineb(&rio, command, BUFFER_SIZE)) > 0) {
+      command[byte_size - 1] = '\0';
+      classifyCommand(command);
+      if (evaluateCommand(command, self, &rio, monotonicNs()))
+        break;
+    }
+
+    deleteUser(client[0]);
+    deleteUser(peer[0]);
+    free(self->username);
+    free(self);
+    free(peerUser->username);
+    free(peerUser);
+  }
+
+  close(client[0]);
+  close(client[1]);
+  close(peer[0]);
+  close(peer[1]);
+  return 0;
+}
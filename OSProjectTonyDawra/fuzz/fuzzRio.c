@@ -0,0 +1,143 @@
+#include "../helper.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * libFuzzer harness for the rio layer.
+ *
+ * Input layout: byte 0 picks the line limit, byte 1 the largest write on the
+ * sending side and byte 2 seeds the mix of reads; the rest is the payload.
+ * The payload is written with rio_writen to a SOCK_SEQPACKET socketpair, so
+ * every write arrives as its own read and lines are split at the positions the
+ * fuzzer chooses. Unbuffered reads use a stream socket instead, since a short
+ * read would truncate a packet. Every rio call is checked against a model of
+ * its contract.
+ */
+
+#define MAX_PAYLOAD 65536
+
+struct Writer {
+  int fd;
+  const uint8_t *data;
+  size_t size;
+  size_t fragment;
+};
+
+// Function for a thread writing the payload in fragments
+static void *writePayload(void *vargp) {
+  struct Writer *writer = vargp;
+  size_t offset = 0, count;
+
+  while (offset < writer->size) {
+    count = writer->size - offset < writer->fragment ? writer->size - offset : writer->fragment;
+    if (rio_writen(writer->fd, writer->data + offset, count) != (ssize_t)count)
+      abort();
+    offset += count;
+  }
+  shutdown(writer->fd, SHUT_WR);
+  return NULL;
+}
+
+// Read the payload back through a rio buffer, mixing line and block reads
+static void checkBuffered(int fd, const uint8_t *payload, size_t size, size_t maxlen,
+                          unsigned seed) {
+  char buffer[2 * RIO_BUFSIZE];
+  size_t offset = 0, expected, wanted;
+  ssize_t count;
+  rio_t rio;
+
+  rio_readinitb(&rio, fd);
+  while (1) {
+    if (rand_r(&seed) % 2) {
+      count = rio_readlineb(&rio, buffer, maxlen);
+      // A line stops after a newline, at maxlen - 1 bytes or at the end of the payload
+      const uint8_t *newline = memchr(payload + offset, '\n', size - offset);
+      expected = newline ? (size_t)(newline - payload - offset) + 1 : size - offset;
+      if (expected > maxlen - 1)
+        expected = maxlen - 1;
+      if (count < 0 || (size_t)count != expected || buffer[count] != '\0')
+        abort();
+    } else {
+      // A block read only returns short at the end of the payload
+      wanted = 1 + rand_r(&seed) % RIO_BUFSIZE;
+      count = rio_readnb(&rio, buffer, wanted);
+      if (count < 0 || (size_t)count != (wanted < size - offset ? wanted : size - offset))
+        abort();
+    }
+    if (memcmp(buffer, payload + offset, (size_t)count) != 0)
+      abort();
+    offset += (size_t)count;
+    if (count == 0) {
+      if (offset != size)
+        abort(); // End of file before the whole payload was read
+      return;
+    }
+  }
+}
+
+// Read the payload back with unbuffered rio_readn calls
+static void checkUnbuffered(int fd, const uint8_t *payload, size_t size, unsigned seed) {
+  char buffer[RIO_BUFSIZE];
+  size_t offset = 0, wanted;
+  ssize_t count;
+
+  do {
+    wanted = 1 + rand_r(&seed) % sizeof(buffer);
+    count = rio_readn(fd, buffer, wanted);
+    // rio_readn only returns short at the end of the payload
+    if (count < 0 || (size_t)count != (wanted < size - offset ? wanted : size - offset) ||
+        memcmp(buffer, payload + offset, (size_t)count) != 0)
+      abort();
+    offset += (size_t)count;
+  } while (count > 0);
+}
+
+// Send the payload through a fresh socketpair and run one of the checks on it
+static void roundTrip(const uint8_t *payload, size_t size, size_t fragment, size_t maxlen,
+                      unsigned seed, int buffered) {
+  struct Writer writer;
+  pthread_t tid;
+  int fds[2];
+
+  if (socketpair(AF_UNIX, buffered ? SOCK_SEQPACKET : SOCK_STREAM, 0, fds) == -1)
+    abort();
+  writer.fd = fds[1];
+  writer.data = payload;
+  writer.size = size;
+  writer.fragment = fragment;
+  pthread_create(&tid, NULL, writePayload, &writer);
+
+  if (buffered)
+    checkBuffered(fds[0], payload, size, maxlen, seed);
+  else
+    checkUnbuffered(fds[0], payload, size, seed);
+
+  pthread_join(tid, NULL);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  size_t maxlen, fragment;
+  unsigned seed;
+
+  if (size < 3 || size - 3 > MAX_PAYLOAD)
+    return 0;
+
+  // A limit of 1 leaves no room for data, so rio_readlineb could not be told from end of file
+  maxlen = 2 + data[0] % 64 + (data[0] >= 192 ? RIO_BUFSIZE : 0);
+  fragment = 1 + data[1];
+  seed = data[2];
+
+  roundTrip(data + 3, size - 3, fragment, maxlen, seed, 1);
+  roundTrip(data + 3, size - 3, fragment, maxlen, seed, 0);
+
+  // Writing nothing must succeed without touching the descriptor
+  if (rio_writen(-1, data, 0) != 0)
+    abort();
+  return 0;
+}
@@ -0,0 +1,76 @@
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * Replay driver for the fuzz harnesses when libFuzzer is not available.
+ * Every file named on the command line, or found in a named directory, is
+ * passed once to LLVMFuzzerTestOneInput; build it with sanitizers enabled.
+ *
+ * Usage: fuzzer-replay path...
+ */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+// Function to run the harness on one file, returns 0 on success
+static int replayFile(const char *path) {
+  FILE *file = fopen(path, "rb");
+  uint8_t *data;
+  long size;
+
+  if (file == NULL || fseek(file, 0, SEEK_END) == -1 || (size = ftell(file)) < 0) {
+    perror(path);
+    if (file != NULL)
+      fclose(file);
+    return -1;
+  }
+  rewind(file);
+
+  data = malloc(size > 0 ? size : 1);
+  if (data == NULL || fread(data, 1, size, file) != (size_t)size) {
+    perror(path);
+    fclose(file);
+    free(data);
+    return -1;
+  }
+  fclose(file);
+
+  LLVMFuzzerTestOneInput(data, size);
+  free(data);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  char path[4096];
+  struct dirent *entry;
+  struct stat pathStat;
+  int runs = 0, failures = 0;
+  DIR *dir;
+
+  for (int i = 1; i < argc; i++) {
+    if (stat(argv[i], &pathStat) == 0 && S_ISDIR(pathStat.st_mode)) {
+      if ((dir = opendir(argv[i])) == NULL) {
+        perror(argv[i]);
+        failures++;
+        continue;
+      }
+      while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+          continue;
+        snprintf(path, sizeof(path), "%s/%s", argv[i], entry->d_name);
+        failures += replayFile(path) != 0;
+        runs++;
+      }
+      closedir(dir);
+    } else {
+      failures += replayFile(argv[i]) != 0;
+      runs++;
+    }
+  }
+
+  printf("Replayed %d inputs, %d unreadable\n", runs, failures);
+  return failures != 0;
+}
@@ -50,8 +50,8 @@ ssize_t rio_writen(int fd, const void *usrbuf, size_t n) {
 
   while (nleft > 0) {
     if ((nwritten = write(fd, bufp, nleft)) <= 0) {
-      if (errno != EINTR) {
-        return -1; // Error other than interruption, return -1
+      if (nwritten == 0 || errno != EINTR) {
+        return -1; // Error other than interruption, errno is stale when nothing was written
       }
 
       nwritten = 0; // Retry if write was interrupted
@@ -157,7 +157,8 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
       }
     } else if (rc == 0) {
       if (n == 1) {
-        return 0; // Empty line
+        *bufp = 0; // Leave an empty string behind at end of file
+        return 0;
       } else {
         break; // End of file
       }
@@ -1,25 +1,111 @@
+#define _GNU_SOURCE // splice, pipe sizing and CPU affinity
 #include "helper.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BUFFER_SIZE 1000
+#define STREAM_PIPE_SIZE (1 << 20) // Requested pipe capacity, bounds memory used by one transfer
+
+#define RATE_TYPES 5               // Number of rate limited command types
+#define ADDRESS_TABLE_SIZE 4096    // Slots in the per source IP bucket table (power of two)
+#define ADDRESS_PROBE_LIMIT 8      // Maximum linear probes for a source IP slot
+#define ADDRESS_IDLE_NS 60000000000LL // Idle time after which a source IP slot may be reused
+
+#define MAX_NODES 64               // Highest NUMA node number probed in sysfs
+#define AFFINITY_FLUSH 64          // Commands counted locally before updating the shared counters
 
 pthread_mutex_t mutex;
+
+// Command types with independent rate limits
+enum CommandType {
+  CMD_UNLIMITED = -1, // Never throttled (quit)
+  CMD_BROADCAST,      // msg "text"
+  CMD_DIRECT,         // msg "text" user
+  CMD_ONLINE,         // online
+  CMD_PING,           // ping
+  CMD_OTHER           // help, stats, send and invalid commands
+};
+
+const char *commandTypeNames[RATE_TYPES] = {"broadcast", "direct", "online", "ping", "other"};
+
+// Token bucket parameters: tokens added per second and maximum burst size
+struct RateLimit {
+  double rate;
+  double burst;
+};
+
+// Limits for each connection and for all connections sharing a source IP
+struct RateLimit connectionLimits[RATE_TYPES] = {{5, 10}, {10, 20}, {2, 5}, {20, 20}, {5, 10}};
+struct RateLimit addressLimits[RATE_TYPES] = {{20, 40}, {40, 80}, {8, 20}, {80, 80}, {20, 40}};
+
+// Longest time a command may be deferred before it is dropped instead
+long long maxDeferNs = 200000000LL;
+
+struct TokenBucket {
+  double tokens;
+  long long last_ns; // Monotonic time of the last refill, 0 if never used
+};
+
+// Token buckets shared by all connections from one source IP
+struct AddressBuckets {
+  uint32_t address;
+  int in_use;
+  long long last_seen; // Monotonic time of the last command from this address
+  struct TokenBucket buckets[RATE_TYPES];
+};
+
+struct AddressBuckets addressTable[ADDRESS_TABLE_SIZE];
+pthread_mutex_t rateMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Throttling counters per command type, updated atomically
+unsigned long rateAdmitted[RATE_TYPES];
+unsigned long rateDeferred[RATE_TYPES];
+unsigned long rateDropped[RATE_TYPES];
+
+// CPU placement of client threads
+int cpuNode[CPU_SETSIZE];   // NUMA node of each CPU, 0 when unknown
+cpu_set_t workerCpus;       // CPUs client threads are pinned to
+int workerCpuCount = 0;     // 0 leaves client threads unpinned
+int workerCpuNext = 0;      // Round robin cursor, only used by the accept thread
+
+// Commands handled on the CPU that received them, on the same node, or on another node,
+// only counted with -S since reading the receiving CPU costs a system call per command
+int trackLocality = 0;
+unsigned long affinitySameCpu, affinitySameNode, affinityOtherNode;
+
 struct Client {
   char *username;
   int connection_fd;
+  int receiving; // Sender connection while a stream is relayed to this client, 0 otherwise
+  pthread_mutex_t write_mutex; // Keeps writes whole, taken after the global mutex if both are held
   struct Client *next;
 };
 
 struct Client *userList = NULL;
 
+// Per connection state used on every command, mapped by the client thread itself
+struct Connection {
+  rio_t rio;
+  struct Client client;
+  struct TokenBucket buckets[RATE_TYPES];
+  char username[BUFFER_SIZE];
+  char command[BUFFER_SIZE];
+};
+
 // Function to add a user to the linked list of users
 void addUser(struct Client *user) {
   if (userList == NULL) {
@@ -33,7 +119,7 @@ void addUser(struct Client *user) {
   }
 }
 
-// Function to delete a user from the linked list of users
+// Function to remove a user from the linked list of users, the caller releases its memory
 void deleteUser(int connection_fd) {
   struct Client *user = userList;
   struct Client *previous = NULL;
@@ -53,8 +139,10 @@ void deleteUser(int connection_fd) {
   else
     previous->next = user->next; // If the user is not the first
 
-  free(user->username);
-  free(user);
+  // Wait for a stream chunk still being written to the user
+  pthread_mutex_lock(&user->write_mutex);
+  pthread_mutex_unlock(&user->write_mutex);
+  pthread_mutex_destroy(&user->write_mutex);
 }
 
 // Function to create a listening socket
@@ -114,54 +202,532 @@ int createListeningSocket(char *port) {
   return listen_fd;
 }
 
+// Function to read the monotonic clock in nanoseconds
+long long monotonicNs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Function to classify a command line without fully parsing it
+int classifyCommand(const char *command) {
+  if (!strncmp(command, "msg", 3)) {
+    // A direct message has a receiver after the closing quote
+    const char *quote = strrchr(command, '"');
+    if (quote != NULL && quote != strchr(command, '"')) {
+      for (quote++; *quote != '\0'; quote++) {
+        if (*quote != ' ' && *quote != '\t' && *quote != '\r')
+          return CMD_DIRECT;
+      }
+    }
+    return CMD_BROADCAST;
+  }
+  if (!strcmp(command, "online"))
+    return CMD_ONLINE;
+  if (!strncmp(command, "ping", 4))
+    return CMD_PING;
+  if (!strcmp(command, "quit"))
+    return CMD_UNLIMITED;
+  return CMD_OTHER;
+}
+
+// Function to refill a token bucket and return the nanoseconds until one token is available
+long long bucketWait(struct TokenBucket *bucket, const struct RateLimit *limit, long long now) {
+  if (limit->rate <= 0)
+    return 0; // Unlimited
+
+  if (bucket->last_ns == 0) {
+    bucket->tokens = limit->burst;
+  } else {
+    bucket->tokens += (double)(now - bucket->last_ns) * limit->rate / 1e9;
+    if (bucket->tokens > limit->burst)
+      bucket->tokens = limit->burst;
+  }
+  bucket->last_ns = now;
+
+  if (bucket->tokens >= 1)
+    return 0;
+  return (long long)((1 - bucket->tokens) / limit->rate * 1e9) + 1;
+}
+
+// Function to find or claim the bucket slot of a source IP, called with rateMutex held
+struct AddressBuckets *findAddressBuckets(uint32_t address, long long now) {
+  uint32_t slot = (address * 2654435761u) & (ADDRESS_TABLE_SIZE - 1);
+  struct AddressBuckets *reusable = NULL;
+
+  for (int i = 0; i < ADDRESS_PROBE_LIMIT; i++) {
+    struct AddressBuckets *entry = &addressTable[(slot + i) & (ADDRESS_TABLE_SIZE - 1)];
+    if (entry->in_use && entry->address == address) {
+      entry->last_seen = now;
+      return entry;
+    }
+    // Remember the first empty or idle slot in case the address is not present
+    if (reusable == NULL && (!entry->in_use || now - entry->last_seen > ADDRESS_IDLE_NS))
+      reusable = entry;
+  }
+
+  if (reusable != NULL) {
+    memset(reusable, 0, sizeof(struct AddressBuckets));
+    reusable->address = address;
+    reusable->in_use = 1;
+    reusable->last_seen = now;
+  }
+  return reusable;
+}
+
+/*
+ * Admit a command against the connection and source IP token buckets.
+ * Commands short of a token by less than maxDeferNs are deferred by sleeping on
+ * the reading thread, which also pushes back on the sender through TCP flow control.
+ *
+ * @return: 1 if the command may run, 0 if it must be dropped
+ */
+int admitCommand(struct TokenBucket *connectionBuckets, uint32_t address, int type, long long now) {
+  long long wait, addressWait;
+  struct AddressBuckets *entry;
+
+  if (type == CMD_UNLIMITED)
+    return 1;
+
+  // Check the connection bucket first so a flooding client never takes the shared lock
+  wait = bucketWait(&connectionBuckets[type], &connectionLimits[type], now);
+  if (wait > maxDeferNs) {
+    __atomic_fetch_add(&rateDropped[type], 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  pthread_mutex_lock(&rateMutex);
+  entry = findAddressBuckets(address, now);
+  if (entry != NULL) {
+    addressWait = bucketWait(&entry->buckets[type], &addressLimits[type], now);
+    if (addressWait > wait)
+      wait = addressWait;
+  }
+  if (wait > maxDeferNs) {
+    pthread_mutex_unlock(&rateMutex);
+    __atomic_fetch_add(&rateDropped[type], 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  // Reserve the tokens now; a deferred command pays them back while it sleeps
+  connectionBuckets[type].tokens -= 1;
+  if (entry != NULL)
+    entry->buckets[type].tokens -= 1;
+  pthread_mutex_unlock(&rateMutex);
+
+  if (wait > 0) {
+    struct timespec delay = {wait / 1000000000LL, wait % 1000000000LL};
+    __atomic_fetch_add(&rateDeferred[type], 1, __ATOMIC_RELAXED);
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+      ;
+  }
+
+  __atomic_fetch_add(&rateAdmitted[type], 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/*
+ * Parse a CPU list such as "0-3,8,10-11".
+ *
+ * @param list: CPU list given on the command line
+ * @param set: CPU set to fill
+ * @return: Number of CPUs in the set, or -1 on error
+ */
+int parseCpuList(const char *list, cpu_set_t *set) {
+  int first, last, consumed;
+
+  CPU_ZERO(set);
+  while (*list != '\0') {
+    if (sscanf(list, "%d%n", &first, &consumed) != 1)
+      return -1;
+    list += consumed;
+    last = first;
+    if (*list == '-') {
+      if (sscanf(list + 1, "%d%n", &last, &consumed) != 1)
+        return -1;
+      list += consumed + 1;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE)
+      return -1;
+    for (int cpu = first; cpu <= last; cpu++)
+      CPU_SET(cpu, set);
+    if (*list == ',')
+      list++;
+    else if (*list != '\0')
+      return -1;
+  }
+  return CPU_COUNT(set);
+}
+
+// Function to map every CPU to its NUMA node using sysfs
+void loadCpuNodes(void) {
+  char path[64], list[BUFFER_SIZE];
+  cpu_set_t cpus;
+  FILE *file;
+
+  for (int node = 0; node < MAX_NODES; node++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if ((file = fopen(path, "r")) == NULL)
+      continue;
+    if (fgets(list, sizeof(list), file) != NULL) {
+      list[strcspn(list, "\n")] = '\0';
+      if (parseCpuList(list, &cpus) > 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+          if (CPU_ISSET(cpu, &cpus))
+            cpuNode[cpu] = node;
+        }
+      }
+    }
+    fclose(file);
+  }
+}
+
+// Function to read the CPU that processed the most recent packets of a socket
+int incomingCpu(int connection_fd) {
+  int cpu = -1;
+  socklen_t cpu_len = sizeof(cpu);
+
+  if (getsockopt(connection_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpu_len) == -1 ||
+      cpu < 0 || cpu >= CPU_SETSIZE)
+    return -1;
+  return cpu;
+}
+
+/*
+ * Choose the worker CPU for a new connection: the CPU its packets arrive on when
+ * that is a worker, otherwise the next worker on the same node, otherwise the next
+ * worker in round robin order. Called only by the accept thread.
+ *
+ * @param rx_cpu: CPU reported by SO_INCOMING_CPU, or -1
+ * @return: CPU to pin the client thread to
+ */
+int pickWorkerCpu(int rx_cpu) {
+  int fallback = -1, cpu;
+
+  if (rx_cpu >= 0 && CPU_ISSET(rx_cpu, &workerCpus))
+    return rx_cpu;
+
+  for (int i = 0; i < CPU_SETSIZE; i++) {
+    cpu = (workerCpuNext + i) % CPU_SETSIZE;
+    if (!CPU_ISSET(cpu, &workerCpus))
+      continue;
+    if (fallback == -1)
+      fallback = cpu;
+    if (rx_cpu < 0 || cpuNode[cpu] == cpuNode[rx_cpu]) {
+      workerCpuNext = cpu + 1;
+      return cpu;
+    }
+  }
+  workerCpuNext = fallback + 1;
+  return fallback;
+}
+
+// Function to add a client thread's locality counts to the shared counters
+void flushAffinity(unsigned long *counts) {
+  __atomic_fetch_add(&affinitySameCpu, counts[0], __ATOMIC_RELAXED);
+  __atomic_fetch_add(&affinitySameNode, counts[1], __ATOMIC_RELAXED);
+  __atomic_fetch_add(&affinityOtherNode, counts[2], __ATOMIC_RELAXED);
+  counts[0] = counts[1] = counts[2] = 0;
+}
+
+// Function to split a command into its keyword, quoted message and receiver
+void parseCommand(const char *command, char *keyword, char *message, char *receiver) {
+  keyword[0] = '\0';
+  message[0] = '\0';
+  receiver[0] = '\0';
+  sscanf(command, "%999s \" %999[^\"] \"%999s", keyword, message, receiver);
+}
+
+/*
+ * Format a chat message frame, truncating the text so the frame always fits.
+ *
+ * @param response: Buffer of BUFFER_SIZE bytes
+ * @param message: Message text
+ * @param sender: Username of the sender
+ * @return: Length of the frame
+ */
+int formatMessage(char *response, char *message, char *sender) {
+  int length = snprintf(response, BUFFER_SIZE, "start\n%s:%s\n\r\n", sender, message);
+
+  if (length >= BUFFER_SIZE) {
+    // Keep the frame terminator at the end of the truncated text
+    memcpy(response + BUFFER_SIZE - 4, "\n\r\n", 4);
+    length = BUFFER_SIZE - 1;
+  }
+  return length;
+}
+
+/*
+ * Check a username before it joins the chat. Names are listed one per line by
+ * "online" and start every chat frame, so they may not contain whitespace or
+ * control characters, nor be a word clients treat as a control line.
+ *
+ * @param username: Username sent by the client
+ * @return: 1 if the username is acceptable, 0 otherwise
+ */
+int validUsername(const char *username) {
+  const char *reserved[] = {"abort", "start", "exit"};
+
+  if (username[0] == '\0')
+    return 0;
+  for (const char *c = username; *c != '\0'; c++) {
+    if ((unsigned char)*c <= ' ' || *c == 127)
+      return 0;
+  }
+  for (size_t i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++) {
+    if (!strcmp(username, reserved[i]))
+      return 0;
+  }
+  return 1;
+}
+
+// Function to write to a client without splitting a stream chunk relayed to it
+ssize_t writeClient(struct Client *user, const void *buffer, size_t n) {
+  ssize_t written;
+
+  pthread_mutex_lock(&user->write_mutex);
+  written = rio_writen(user->connection_fd, buffer, n);
+  pthread_mutex_unlock(&user->write_mutex);
+  return written;
+}
+
 // Function to send a message to all clients except the sender
-void sendMessageToAll(int connection_fd, char *message, char *sender) {
+void sendMessageToAll(struct Client *sender, char *message) {
   char response[BUFFER_SIZE];
   struct Client *user = userList;
+  int length;
 
+  // Prepare the message format once and send it to each client
+  length = formatMessage(response, message, sender->username);
   while (user != NULL) {
-    if (user->connection_fd != connection_fd) {
-      // Prepare the message format and send it to each client
-      sprintf(response, "start\n%s:%s\n\r\n", sender, message);
-      rio_writen(user->connection_fd, response, strlen(response));
-    }
+    if (user != sender)
+      writeClient(user, response, length);
     user = user->next;
   }
 
   // Notify the sender that the message was sent to all
   strcpy(response, "Message sent to all\n\r\n");
-  rio_writen(connection_fd, response, strlen(response));
+  writeClient(sender, response, strlen(response));
 }
 
 // Function to send a message to a specific client
-void sendMessage(int connection_fd, char *message, char *receiver, char *sender) {
+void sendMessage(struct Client *sender, char *message, char *receiver) {
   char response[BUFFER_SIZE];
   struct Client *user = userList;
 
   // If no specific receiver is specified, send the message to all clients
   if (receiver == NULL || receiver[0] == '\0') {
-    sendMessageToAll(connection_fd, message, sender);
+    sendMessageToAll(sender, message);
   } else {
     while (user != NULL) {
       // Find the user with the specified username and send the message
       if (!strcmp(user->username, receiver)) {
-        sprintf(response, "start\n%s:%s\n\r\n", sender, message);
-        rio_writen(user->connection_fd, response, strlen(response));
+        writeClient(user, response, formatMessage(response, message, sender->username));
         // Notify the sender that the message was sent
         strcpy(response, "Message sent\n\r\n");
-        rio_writen(connection_fd, response, strlen(response));
+        writeClient(sender, response, strlen(response));
         return;
       }
       user = user->next;
     }
     // Notify the sender that the specified user was not found
     strcpy(response, "User not found\n\r\n");
-    rio_writen(connection_fd, response, strlen(response));
+    writeClient(sender, response, strlen(response));
+  }
+}
+
+// Function to find a user by username, called with the mutex held
+struct Client *findUser(char *username) {
+  struct Client *user = userList;
+
+  while (user != NULL && strcmp(user->username, username))
+    user = user->next;
+  return user;
+}
+
+/*
+ * Move n bytes from a pipe to a socket without copying them to user space.
+ *
+ * @param pipe_fd: Read end of the pipe
+ * @param out_fd: Destination socket
+ * @param n: Number of bytes to move
+ * @return: Number of bytes moved, or -1 on error
+ */
+ssize_t spliceAll(int pipe_fd, int out_fd, size_t n) {
+  size_t nleft = n;
+  ssize_t nmoved;
+
+  while (nleft > 0) {
+    if ((nmoved = splice(pipe_fd, NULL, out_fd, NULL, nleft, SPLICE_F_MOVE | SPLICE_F_MORE)) <= 0) {
+      if (nmoved < 0 && errno == EINTR)
+        continue; // Retry if splice was interrupted
+      return -1;
+    }
+    nleft -= (size_t)nmoved;
   }
+  return (ssize_t)n;
 }
 
-// Function to evaluate and execute client commands
-void evaluateCommand(char *command, int connection_fd, char *username) {
+// Function to read and discard the payload announced by a stream header that is not relayed
+void skipStream(rio_t *rp, char *command) {
+  char discard[BUFFER_SIZE];
+  long long left;
+  ssize_t count;
+
+  if (sscanf(command, "send %*s %lld", &left) != 1)
+    return; // Malformed headers announce no payload
+  for (; left > 0; left -= count) {
+    count = left < (long long)sizeof(discard) ? left : (long long)sizeof(discard);
+    if ((count = rio_readnb(rp, discard, count)) <= 0)
+      return; // Sender disconnected
+  }
+}
+
+/*
+ * Relay a stream of raw bytes announced by "send user size name" to the receiver.
+ * The payload is forwarded in chunks framed as "chunk n" so chat messages can be
+ * delivered between them. Bytes move from the sender socket through a pipe to the
+ * receiver socket with splice, so memory use is bounded by the pipe capacity.
+ *
+ * @param rp: Rio buffer of the sender, which may already hold part of the payload
+ * @param sender: Client sending the stream
+ * @param command: Stream header
+ */
+void relayStream(rio_t *rp, struct Client *sender, char *command) {
+  char response[BUFFER_SIZE];
+  char receiver[BUFFER_SIZE];
+  char name[BUFFER_SIZE];
+  char header[BUFFER_SIZE];
+  char discard[BUFFER_SIZE];
+  char *buffered = NULL;
+  long long size, left;
+  ssize_t count;
+  int pipe_fd[2], from_pipe, delivered = 0, chunk_size, header_fits;
+  int connection_fd = sender->connection_fd;
+  struct Client *user;
+
+  if (sscanf(command, "send %999s %lld %999[^\n]", receiver, &size, name) != 3 || size < 0) {
+    strcpy(response, "Invalid command\n\r\n");
+    writeClient(sender, response, strlen(response));
+    return;
+  }
+
+  // The header names the sender, so long usernames and file names may not fit
+  header_fits = snprintf(header, sizeof(header), "file %s %lld %s\n", sender->username, size,
+                         name) <
+                (int)sizeof(header);
+
+  if (pipe(pipe_fd) == -1) {
+    perror("Pipe creation failed");
+    pipe_fd[0] = pipe_fd[1] = -1;
+  } else {
+    // A larger pipe lets each chunk carry more data per lock acquisition
+    fcntl(pipe_fd[1], F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+  }
+  chunk_size = pipe_fd[1] == -1 ? 0 : fcntl(pipe_fd[1], F_GETPIPE_SZ);
+
+  // Claim the receiver so only one stream is relayed to it at a time
+  pthread_mutex_lock(&mutex);
+  user = findUser(receiver);
+  if (user != NULL && !user->receiving && chunk_size > 0 && header_fits) {
+    user->receiving = connection_fd;
+    delivered = 1;
+    writeClient(user, header, strlen(header));
+  }
+  pthread_mutex_unlock(&mutex);
+
+  if (!delivered)
+    strcpy(response, !header_fits      ? "Invalid command\n\r\n"
+                     : chunk_size <= 0 ? "Transfer failed on the server\n\r\n"
+                     : user == NULL    ? "User not found\n\r\n"
+                                       : "User busy\n\r\n");
+
+  for (left = size; left > 0; left -= count) {
+    if (rp->rio_cnt > 0) {
+      // Bytes already read ahead into the rio buffer are forwarded from there without
+      // refilling it, so the rest of the payload is spliced straight from the socket
+      count = left < rp->rio_cnt ? left : rp->rio_cnt;
+      buffered = rp->rio_bufptr;
+      rp->rio_bufptr += count;
+      rp->rio_cnt -= count;
+      from_pipe = 0;
+    } else if (delivered) {
+      count = splice(connection_fd, NULL, pipe_fd[1], NULL,
+                     left < chunk_size ? left : chunk_size, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (count < 0 && errno == EINTR) {
+        count = 0; // Retry if splice was interrupted
+        continue;
+      }
+      from_pipe = 1;
+    } else {
+      count = left < (long long)sizeof(discard) ? left : (long long)sizeof(discard);
+      count = rio_readnb(rp, discard, count);
+    }
+
+    if (count <= 0)
+      break; // Sender disconnected
+
+    if (!delivered)
+      continue; // Payload for a missing or busy receiver is discarded
+
+    pthread_mutex_lock(&mutex);
+    user = findUser(receiver);
+    if (user != NULL && user->receiving == connection_fd)
+      pthread_mutex_lock(&user->write_mutex);
+    else
+      user = NULL;
+    pthread_mutex_unlock(&mutex);
+
+    // Only the receiver's write lock is held for the chunk, so a receiver that reads
+    // slowly does not hold up clients waiting for the user list
+    if (user != NULL) {
+      snprintf(response, sizeof(response), "chunk %zd\n", count);
+      if (rio_writen(user->connection_fd, response, strlen(response)) == -1 ||
+          (from_pipe ? spliceAll(pipe_fd[0], user->connection_fd, count)
+                     : rio_writen(user->connection_fd, buffered, count)) == -1) {
+        delivered = 0;
+      }
+      pthread_mutex_unlock(&user->write_mutex);
+    } else {
+      delivered = 0;
+    }
+
+    if (!delivered) {
+      // Part of the chunk may have been moved already, so the pipe is closed rather than
+      // drained; the rest of the payload is discarded without it
+      if (from_pipe) {
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        pipe_fd[0] = pipe_fd[1] = -1;
+      }
+      strcpy(response, "Transfer aborted\n\r\n");
+    }
+  }
+
+  // Release the receiver and tell it if the stream ended early
+  pthread_mutex_lock(&mutex);
+  user = findUser(receiver);
+  if (user != NULL && user->receiving == connection_fd) {
+    if (left > 0 || !delivered)
+      writeClient(user, "abort\n", 6);
+    user->receiving = 0;
+  }
+  pthread_mutex_unlock(&mutex);
+
+  if (pipe_fd[0] != -1) {
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+  }
+
+  if (left > 0)
+    strcpy(response, "Transfer aborted\n\r\n");
+  else if (delivered)
+    strcpy(response, !strcmp(name, "-") ? "Message sent\n\r\n" : "File sent\n\r\n");
+  writeClient(sender, response, strlen(response));
+}
+
+// Function to evaluate and execute client commands, returns 1 once the client quits
+int evaluateCommand(char *command, struct Client *self, rio_t *rp, long long received_ns) {
   char response[BUFFER_SIZE];
   char message[BUFFER_SIZE];
   char receiver[BUFFER_SIZE];
@@ -175,111 +741,187 @@ void evaluateCommand(char *command, int connection_fd, char *username) {
 
   // Handle the "help" command
   if (!strcmp(command, "help")) {
-    sprintf(response,
-            "msg \"text\": Send a message to all clients online\n");
-    sprintf(response,
-            "%smsg \"text\" user: Send a message to a specific client\n",
-            response);
-    sprintf(response, "%sonline: Get the username of all clients online\n",
-            response);
-    sprintf(response, "%squit: Exit the chatroom\n\r\n", response);
-    rio_writen(connection_fd, response, strlen(response));
-    return;
+    strcpy(response,
+           "msg \"text\": Send a message to all clients online\n"
+           "msg \"text\" user: Send a message to a specific client\n"
+           "online: Get the username of all clients online\n"
+           "send file user: Send a file to a specific client\n"
+           "ping [token]: Echo token with server receive, dispatch and pre-write times\n"
+           "stats: Show rate limiting counters\n"
+           "quit: Exit the chatroom\n\r\n");
+    writeClient(self, response, strlen(response));
+    return 0;
   }
 
   // Handle the "online" command
   if (!strcmp(command, "online")) {
     char online_users[BUFFER_SIZE];
-    online_users[0] = '\0'; 
+    size_t length = 0, name_length;
 
     pthread_mutex_lock(&mutex);
 
-    // Concatenate the usernames of online users
+    // Concatenate the usernames of online users, leaving room for the terminator
     struct Client *current_user = userList;
     while (current_user != NULL) {
-      strcat(online_users, current_user->username); 
-      strcat(online_users, "\n"); 
+      name_length = strlen(current_user->username);
+      if (length + name_length + 1 > sizeof(online_users) - 3)
+        break;
+      memcpy(online_users + length, current_user->username, name_length);
+      online_users[length + name_length] = '\n';
+      length += name_length + 1;
       current_user = current_user->next;
     }
 
     pthread_mutex_unlock(&mutex);
 
     // Add the terminating characters and send the list to the client
-    strcat(online_users, "\r\n");
-    rio_writen(connection_fd, online_users, strlen(online_users));
-    return;
+    memcpy(online_users + length, "\r\n", 2);
+    writeClient(self, online_users, length + 2);
+    return 0;
   }
 
-  // Handle the "quit" command
-  if (!strcmp(command, "quit")) {
+  // Handle the "ping" command
+  if (!strcmp(command, "ping") || !strncmp(command, "ping ", 5)) {
+    long long dispatch_ns;
+    char *token = command[4] == ' ' ? command + 5 : "-";
+
+    // Dispatch is timed after the mutex so the reply shows queueing behind other writers
     pthread_mutex_lock(&mutex);
-    // Delete the user from the list and notify the client to exit
-    deleteUser(connection_fd);
+    dispatch_ns = monotonicNs();
     pthread_mutex_unlock(&mutex);
+    snprintf(message, sizeof(message), "%.*s", 100, token);
+
+    // The pre-write time is taken once the client's write lock is held, so waiting behind a
+    // stream chunk counts as server time and only the write itself counts as transport
+    pthread_mutex_lock(&self->write_mutex);
+    snprintf(response, sizeof(response), "pong %s %lld %lld %lld\n\r\n", message, received_ns,
+             dispatch_ns, monotonicNs());
+    rio_writen(self->connection_fd, response, strlen(response));
+    pthread_mutex_unlock(&self->write_mutex);
+    return 0;
+  }
+
+  // Handle the "stats" command
+  if (!strcmp(command, "stats")) {
+    int length = 0;
+
+    // Report admitted, deferred and dropped commands for each command type
+    for (int type = 0; type < RATE_TYPES; type++) {
+      length += snprintf(response + length, sizeof(response) - length,
+                         "%s: admitted %lu deferred %lu dropped %lu\n",
+                         commandTypeNames[type],
+                         __atomic_load_n(&rateAdmitted[type], __ATOMIC_RELAXED),
+                         __atomic_load_n(&rateDeferred[type], __ATOMIC_RELAXED),
+                         __atomic_load_n(&rateDropped[type], __ATOMIC_RELAXED));
+    }
+    if (trackLocality)
+      length += snprintf(response + length, sizeof(response) - length,
+                         "affinity: same cpu %lu same node %lu other node %lu\n",
+                         __atomic_load_n(&affinitySameCpu, __ATOMIC_RELAXED),
+                         __atomic_load_n(&affinitySameNode, __ATOMIC_RELAXED),
+                         __atomic_load_n(&affinityOtherNode, __ATOMIC_RELAXED));
+    strcat(response, "\r\n");
+    writeClient(self, response, strlen(response));
+    return 0;
+  }
+
+  // Handle the "quit" command
+  if (!strcmp(command, "quit")) {
+    // Notify the client to exit, the user is deleted once the connection is closed
     strcpy(response, "exit");
-    rio_writen(connection_fd, response, strlen(response));
-    close(connection_fd);
-    return;
+    writeClient(self, response, strlen(response));
+    return 1;
+  }
+
+  // Handle the "send" command, which is followed by a raw byte stream
+  if (!strncmp(command, "send ", 5)) {
+    relayStream(rp, self, command);
+    return 0;
   }
 
   // Parse the command to extract the keyword, message, and receiver
-  sscanf(command, "%s \" %[^\"] \"%s", keyword, message, receiver);
+  parseCommand(command, keyword, message, receiver);
 
   // Handle the "msg" command
   if (!strcmp(keyword, "msg")) {
     pthread_mutex_lock(&mutex);
     // If no specific receiver is specified, send the message to all clients
     if (receiver[0] == '\0') {
-      sendMessageToAll(connection_fd, message, username);
+      sendMessageToAll(self, message);
     } else {
       // Send the message to the specified receiver
-      sendMessage(connection_fd, message, receiver, username);
+      sendMessage(self, message, receiver);
     }
     pthread_mutex_unlock(&mutex);
   } else {
     // Notify the client of an invalid command
     strcpy(response, "Invalid command\n\r\n");
-    rio_writen(connection_fd, response, strlen(response));
+    writeClient(self, response, strlen(response));
   }
+
+  return 0;
 }
 
 // Function to handle communication with a client
 void *handleClient(void *vargp) {
-  char username[BUFFER_SIZE];
-  rio_t rio;
+  struct Connection *state;
   struct Client *user;
   long byte_size;
-  char command[BUFFER_SIZE];
+  struct sockaddr_in peer;
+  socklen_t peer_len = sizeof(peer);
+  uint32_t address = 0;
+  unsigned long dropped = 0, locality[3] = {0, 0, 0};
+  long long received_ns;
+  int rx_cpu, cpu;
 
   // Detach the thread
   pthread_detach(pthread_self());
-
   int connection_fd = *((int *)vargp);
-  rio_readinitb(&rio, connection_fd);
 
-  // Read the username from the client
-  if ((byte_size = rio_readlineb(&rio, username, BUFFER_SIZE)) == -1) {
+  // The thread already runs on its chosen CPU. Fresh anonymous pages are placed on the node
+  // of the thread that first touches them, whereas a reused thread stack or malloc arena may
+  // already sit on another node, so the state used on every command is mapped here
+  state = mmap(NULL, sizeof(struct Connection), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (state == MAP_FAILED) {
+    perror("Memory allocation error");
     close(connection_fd);
     free(vargp);
     return NULL;
   }
+  rio_readinitb(&state->rio, connection_fd);
 
-  username[byte_size - 1] = '\0';
+  // Remember the source IP for the shared per address limits
+  if (getpeername(connection_fd, (struct sockaddr *)&peer, &peer_len) == 0 &&
+      peer.sin_family == AF_INET)
+    address = peer.sin_addr.s_addr;
 
-  // Create a new client structure
-  user = malloc(sizeof(struct Client));
+  // Read the username from the client
+  if ((byte_size = rio_readlineb(&state->rio, state->username, BUFFER_SIZE)) <= 0) {
+    close(connection_fd);
+    munmap(state, sizeof(struct Connection));
+    free(vargp);
+    return NULL;
+  }
 
-  if (user == NULL) {
-    perror("Memory allocation error");
+  state->username[byte_size - 1] = '\0';
+
+  // Refuse names that could be mistaken for stream control lines or split the online list
+  if (!validUsername(state->username)) {
+    const char *notice = "Invalid username\n\r\n";
+    rio_writen(connection_fd, notice, strlen(notice));
     close(connection_fd);
+    munmap(state, sizeof(struct Connection));
     free(vargp);
     return NULL;
   }
 
-  // Allocate memory for the username and copy it
-  user->username = malloc(sizeof(username));
-  memcpy(user->username, username, strlen(username) + 1);
+  // Fill in the client structure, which lives in the connection state
+  user = &state->client;
+  user->username = state->username;
   user->connection_fd = connection_fd;
+  user->receiving = 0;
+  pthread_mutex_init(&user->write_mutex, NULL);
 
   // Lock the mutex before modifying the user list
   pthread_mutex_lock(&mutex);
@@ -289,26 +931,191 @@ void *handleClient(void *vargp) {
   pthread_mutex_unlock(&mutex);
 
   // Continuously read commands from the client and evaluate them
-  while ((byte_size = rio_readlineb(&rio, command, BUFFER_SIZE)) > 0) {
+  while ((byte_size = rio_readlineb(&state->rio, state->command, BUFFER_SIZE)) > 0) {
+    char *command = state->command;
     command[byte_size - 1] = '\0';
-    evaluateCommand(command, connection_fd, username);
+    received_ns = monotonicNs();
+
+    // Count whether the command is handled where its packets were received, asking for the
+    // receiving CPU every time since it moves with the sender and interrupt steering
+    if (trackLocality && (rx_cpu = incomingCpu(connection_fd)) >= 0 && (cpu = sched_getcpu()) >= 0) {
+      locality[cpu == rx_cpu ? 0 : cpuNode[cpu] == cpuNode[rx_cpu] ? 1 : 2]++;
+      if (locality[0] + locality[1] + locality[2] >= AFFINITY_FLUSH)
+        flushAffinity(locality);
+    }
+
+    // Drop over limit commands before they reach the shared user list
+    if (!admitCommand(state->buckets, address, classifyCommand(command), received_ns)) {
+      dropped++;
+      // The payload of a dropped stream must not be read as commands
+      if (!strncmp(command, "send ", 5))
+        skipStream(&state->rio, command);
+      // Every command gets one reply, so pipelining clients can match replies in order
+      const char *notice = "Rate limit exceeded, command dropped\n\r\n";
+      writeClient(user, notice, strlen(notice));
+      continue;
+    }
+
+    // Stop reading once the client quits, even if more commands are pipelined
+    if (evaluateCommand(command, user, &state->rio, received_ns))
+      break;
   }
 
+  flushAffinity(locality);
+  if (dropped > 0)
+    printf("Client %s was throttled: %lu commands dropped\n", user->username, dropped);
+
+  // Remove the client, whether it quit or disconnected, before closing the connection
+  pthread_mutex_lock(&mutex);
+  deleteUser(connection_fd);
+  pthread_mutex_unlock(&mutex);
+  close(connection_fd);
+  munmap(state, sizeof(struct Connection));
+  free(vargp);
+
   return NULL;
 }
 
+// Function to display usage information for the server
+void displayUsage() {
+  printf("Usage: server [options] [port]\n");
+  printf("-h  Print help\n");
+  printf("-l  Per connection limit as type=rate:burst\n");
+  printf("-L  Per source IP limit as type=rate:burst\n");
+  printf("-d  Longest deferral in milliseconds before dropping, 0 to 3600000\n");
+  printf("-A  CPU to pin the accept thread to\n");
+  printf("-c  CPUs to pin client threads to, such as 0-3,8\n");
+  printf("-S  Count command locality for stats, one extra system call per command\n");
+  printf("    Types: broadcast, direct, online, ping, other; a rate of 0 disables the limit\n");
+}
+
+/*
+ * Parse a rate limit specification of the form type=rate:burst.
+ *
+ * @param spec: Specification given on the command line
+ * @param limits: Limit table to update
+ * @return: 0 on success, -1 on error
+ */
+int parseRateLimit(char *spec, struct RateLimit *limits) {
+  char name[32];
+  double rate, burst;
+
+  if (sscanf(spec, "%31[^=]=%lf:%lf", name, &rate, &burst) != 3 || rate < 0 || burst < 1)
+    return -1;
+
+  for (int type = 0; type < RATE_TYPES; type++) {
+    if (!strcmp(name, commandTypeNames[type])) {
+      limits[type].rate = rate;
+      limits[type].burst = burst;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Parse the longest deferral, given in milliseconds.
+ *
+ * @param spec: Milliseconds given on the command line
+ * @param ns: Deferral to update, in nanoseconds
+ * @return: 0 on success, -1 on error
+ */
+int parseDeferral(char *spec, long long *ns) {
+  long long ms;
+  int consumed;
+
+  // Negative values would drop every command, even those under the limit
+  if (sscanf(spec, "%lld%n", &ms, &consumed) != 1 || spec[consumed] != '\0' || ms < 0 ||
+      ms > 3600000LL)
+    return -1;
+  *ns = ms * 1000000LL;
+  return 0;
+}
+
 // Main function for the server
 int main(int argc, char **argv) {
   struct sockaddr_storage client_address;
   socklen_t client_len;
   int listen_fd = -1;
   char *port = "80";
+  int option, accept_cpu = -1;
+  cpu_set_t accept_cpus, process_cpus;
+  pthread_attr_t attr;
+
+  // Parse rate limiting options using getopt
+  while ((option = getopt(argc, argv, "hl:L:d:A:c:S")) != -1) {
+    switch (option) {
+
+    case 'l':
+      if (parseRateLimit(optarg, connectionLimits) == -1) {
+        fprintf(stderr, "Error: Invalid connection limit '%s'\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'L':
+      if (parseRateLimit(optarg, addressLimits) == -1) {
+        fprintf(stderr, "Error: Invalid source IP limit '%s'\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'd':
+      if (parseDeferral(optarg, &maxDeferNs) == -1) {
+        fprintf(stderr, "Error: Invalid deferral '%s'\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'A':
+      if (parseCpuList(optarg, &accept_cpus) != 1) {
+        fprintf(stderr, "Error: Invalid accept CPU '%s'\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      accept_cpu = atoi(optarg);
+      break;
+
+    case 'c':
+      if ((workerCpuCount = parseCpuList(optarg, &workerCpus)) <= 0) {
+        fprintf(stderr, "Error: Invalid CPU list '%s'\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'S':
+      trackLocality = 1;
+      break;
+
+    case 'h':
+    default:
+      displayUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
 
   // If a port is provided as a command-line argument, use it
-  if (argc > 1)
-    port = argv[1];
+  if (optind < argc)
+    port = argv[optind];
 
   pthread_mutex_init(&mutex, NULL);
+  loadCpuNodes();
+
+  // Pin the accept thread before the listening socket is created so its memory is local
+  sched_getaffinity(0, sizeof(process_cpus), &process_cpus);
+  if (workerCpuCount > 0) {
+    CPU_AND(&workerCpus, &workerCpus, &process_cpus);
+    if ((workerCpuCount = CPU_COUNT(&workerCpus)) == 0) {
+      fprintf(stderr, "Error: None of the client thread CPUs are available\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (accept_cpu != -1 && sched_setaffinity(0, sizeof(accept_cpus), &accept_cpus) == -1) {
+    perror("Accept thread affinity failed");
+    exit(EXIT_FAILURE);
+  }
+
+  // Writes to clients that already disconnected must fail instead of killing the server
+  signal(SIGPIPE, SIG_IGN);
 
   // Create a listening socket
   listen_fd = createListeningSocket(port);
@@ -340,14 +1147,26 @@ int main(int argc, char **argv) {
 
     printf("A new client is online\n");
 
-    // Create a new thread to handle the client
+    // Create a new thread to handle the client, pinned to a worker CPU if configured
     pthread_t tid;
-    if (pthread_create(&tid, NULL, handleClient, connection_fd) != 0) {
+    pthread_attr_init(&attr);
+    if (workerCpuCount > 0) {
+      cpu_set_t worker;
+      CPU_ZERO(&worker);
+      CPU_SET(pickWorkerCpu(incomingCpu(*connection_fd)), &worker);
+      pthread_attr_setaffinity_np(&attr, sizeof(worker), &worker);
+    } else if (accept_cpu != -1) {
+      // Unpinned client threads must not inherit the accept thread's CPU
+      pthread_attr_setaffinity_np(&attr, sizeof(process_cpus), &process_cpus);
+    }
+    if (pthread_create(&tid, &attr, handleClient, connection_fd) != 0) {
       perror("Thread creation failed");
       free(connection_fd);
       close(*connection_fd);
+      pthread_attr_destroy(&attr);
       continue;
     }
+    pthread_attr_destroy(&attr);
   }
 
   // Cleanup and close the listening socket